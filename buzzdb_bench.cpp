@@ -0,0 +1,831 @@
+/**
+ * =============================================================================
+ * BuzzDB Lab 1: Benchmark Suite
+ * =============================================================================
+ *
+ * Generates a synthetic dataset of any size, then times every loader, query
+ * and mutation of FlatFile on it and reports throughput plus p50/p99
+ * latency. The same seed always generates the same files and the same
+ * sequence of operations, so two runs (e.g. before/after a change) are
+ * directly comparable.
+ *
+ * With --mode stress it instead runs a mixed read/write workload at 1, 2,
+ * 4, ... --threads threads (see STRESS / SCALING), prints the throughput
+ * curve with lock contention, and fails if any result could not have come
+ * from some serial order of the operations.
+ *
+ * BUILD:
+ *   g++ -std=c++17 -O3 -Wall -Werror -Wextra buzzdb_bench.cpp -o buzzdb_bench.out -pthread
+ *
+ * RUN:
+ *   ./buzzdb_bench.out                          # defaults (see BenchConfig)
+ *   ./buzzdb_bench.out --engagements 5000000 --skew 1.1 --out before.jsonl
+ *   ./buzzdb_bench.out --mode stress --threads 16 --read-ratio 0.9 --view-mode sharded
+ *
+ * OUTPUT:
+ *   - a table on stdout
+ *   - one JSON object per benchmark in --out (JSON Lines), for scripts that
+ *     diff runs and flag regressions
+ *
+ * C++ TIP: this file #includes buzzdb_lab1.cpp with BUZZDB_NO_MAIN defined,
+ * which compiles the whole database (but not its test main()) into this
+ * program. Single-file projects often share code this way.
+ */
+
+#define BUZZDB_NO_MAIN
+#include "buzzdb_lab1.cpp"
+
+#include <cmath>      // For std::pow (Zipf weights)
+#include <cstdlib>    // For std::malloc/std::free (the counting operator new)
+#include <new>        // For std::bad_alloc
+#include <random>     // For std::mt19937_64 (repeatable pseudo-random numbers)
+#include <set>        // For std::set (engagement ids seen by the stress checks)
+#include <sys/stat.h> // For mkdir()
+
+// =============================================================================
+// CONFIGURATION
+// =============================================================================
+
+struct BenchConfig
+{
+    size_t users = 100000;
+    size_t posts = 500000;
+    size_t engagements = 2000000;
+    double skew = 1.0;          // Zipf exponent for who posts/engages and which posts get engagements (0 = uniform)
+    size_t comment_length = 40; // characters per comment
+    double comment_ratio = 0.3; // share of engagements that are comments
+    size_t locations = 50;
+    uint64_t seed = 42;
+
+    size_t load_runs = 5;        // repetitions of each loader
+    size_t query_ops = 20000;    // operations per query benchmark
+    size_t mutation_ops = 500;   // operations per mutation benchmark (each one fsyncs)
+    size_t batch_size = 200;     // ids per batch call
+    string data_dir = "bench_data";
+    string out_path = "bench_output.txt";
+
+    // --mode stress (see STRESS / SCALING)
+    string mode = "bench";
+    size_t threads = max<size_t>(thread::hardware_concurrency(), 1); // largest thread count run
+    size_t stress_ops = 2000;   // operations per thread per round
+    double read_ratio = 0.9;    // share of operations that are reads
+    double add_share = 0.2;     // share of writes that add an engagement
+    double rename_share = 0.05; // share of writes that rename a user (the rest add views)
+    FlatFileOptions stress_options;
+};
+
+static void printUsage()
+{
+    cout << "Usage: buzzdb_bench.out [--users N] [--posts N] [--engagements N] [--skew S]\n"
+         << "                        [--comment-length N] [--comment-ratio R] [--locations N]\n"
+         << "                        [--seed N] [--load-runs N] [--query-ops N] [--mutation-ops N]\n"
+         << "                        [--batch-size N] [--data-dir DIR] [--out FILE]\n"
+         << "       buzzdb_bench.out --mode stress [--threads N] [--stress-ops N] [--read-ratio R]\n"
+         << "                        [--add-share R] [--rename-share R] [--view-mode durable|sharded]\n"
+         << "                        [--read-mode locked|snapshot] [--storage rowmap|columnar]\n"
+         << "                        [--io-backend posix|io_uring] [--query-cache-bytes N]\n"
+         << "                        (plus any dataset flag above)" << endl;
+}
+
+// Returns false (after printing usage) on an unknown flag or a bad value
+static bool parseArgs(int argc, char *argv[], BenchConfig &config)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string flag = argv[i];
+        if (flag == "--help" || i + 1 >= argc)
+        {
+            printUsage();
+            return false;
+        }
+        string value = argv[++i];
+        try
+        {
+            if (flag == "--users")
+                config.users = stoull(value);
+            else if (flag == "--posts")
+                config.posts = stoull(value);
+            else if (flag == "--engagements")
+                config.engagements = stoull(value);
+            else if (flag == "--skew")
+                config.skew = stod(value);
+            else if (flag == "--comment-length")
+                config.comment_length = stoull(value);
+            else if (flag == "--comment-ratio")
+                config.comment_ratio = stod(value);
+            else if (flag == "--locations")
+                config.locations = stoull(value);
+            else if (flag == "--seed")
+                config.seed = stoull(value);
+            else if (flag == "--load-runs")
+                config.load_runs = stoull(value);
+            else if (flag == "--query-ops")
+                config.query_ops = stoull(value);
+            else if (flag == "--mutation-ops")
+                config.mutation_ops = stoull(value);
+            else if (flag == "--batch-size")
+                config.batch_size = stoull(value);
+            else if (flag == "--data-dir")
+                config.data_dir = value;
+            else if (flag == "--out")
+                config.out_path = value;
+            else if (flag == "--mode" && (value == "bench" || value == "stress"))
+                config.mode = value;
+            else if (flag == "--threads")
+                config.threads = stoull(value);
+            else if (flag == "--stress-ops")
+                config.stress_ops = stoull(value);
+            else if (flag == "--read-ratio")
+                config.read_ratio = stod(value);
+            else if (flag == "--add-share")
+                config.add_share = stod(value);
+            else if (flag == "--rename-share")
+                config.rename_share = stod(value);
+            else if (flag == "--view-mode" && (value == "durable" || value == "sharded"))
+                config.stress_options.view_update_mode =
+                    value == "sharded" ? ViewUpdateMode::Sharded : ViewUpdateMode::Durable;
+            else if (flag == "--read-mode" && (value == "locked" || value == "snapshot"))
+                config.stress_options.read_mode = value == "snapshot" ? ReadMode::Snapshot : ReadMode::Locked;
+            else if (flag == "--storage" && (value == "rowmap" || value == "columnar"))
+                config.stress_options.storage_engine =
+                    value == "columnar" ? StorageEngine::Columnar : StorageEngine::RowMap;
+            else if (flag == "--io-backend" && (value == "posix" || value == "io_uring"))
+                config.stress_options.io_backend = value == "io_uring" ? IOBackend::IoUring : IOBackend::Posix;
+            else if (flag == "--query-cache-bytes")
+                config.stress_options.query_cache_bytes = stoull(value);
+            else
+            {
+                printUsage();
+                return false;
+            }
+        }
+        catch (const exception &)
+        {
+            cerr << "Bad value for " << flag << ": " << value << endl;
+            return false;
+        }
+    }
+    if (config.users == 0 || config.posts == 0 || config.locations == 0 || config.batch_size == 0)
+    {
+        cerr << "--users, --posts, --locations and --batch-size must be positive" << endl;
+        return false;
+    }
+    if (config.threads == 0 || config.users < config.threads)
+    {
+        cerr << "--threads must be positive and at most --users" << endl;
+        return false;
+    }
+    if (config.add_share + config.rename_share > 1.0)
+    {
+        cerr << "--add-share + --rename-share must be at most 1" << endl;
+        return false;
+    }
+    return true;
+}
+
+// =============================================================================
+// ALLOCATION COUNTING
+// =============================================================================
+//
+// Replacing the global operator new (allowed once per program) lets every
+// benchmark report heap allocations per item next to its timings, so a
+// change that saves copies shows up as a number, not just as noise in the
+// latency. new[] and the nothrow forms call this one by default. Row-table
+// nodes come from RowArena blocks, so loads count mostly string payloads.
+
+static atomic<uint64_t> heap_allocations{0};
+
+void *operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    if (void *block = malloc(size > 0 ? size : 1))
+        return block;
+    throw bad_alloc();
+}
+
+// noinline: once inlined into library code, GCC pairs the free() with the
+// library's operator new and reports a (false) mismatched-new-delete
+__attribute__((noinline)) void operator delete(void *block) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void *block, size_t) noexcept { free(block); }
+
+// =============================================================================
+// DATA GENERATION
+// =============================================================================
+
+/**
+ * Draws ids 1..n with P(k) proportional to 1 / k^skew (skew 0 = uniform).
+ * Real social data is heavily skewed: a few users and posts get most of the
+ * activity, which is what stresses hash tables and per-user indexes.
+ * The CDF is precomputed once; each draw is a binary search.
+ */
+class ZipfSampler
+{
+    vector<double> cdf;
+
+public:
+    ZipfSampler(size_t n, double skew)
+    {
+        cdf.resize(n);
+        double total = 0;
+        for (size_t k = 0; k < n; k++)
+        {
+            total += 1.0 / pow(static_cast<double>(k + 1), skew);
+            cdf[k] = total;
+        }
+        for (double &c : cdf)
+            c /= total;
+    }
+
+    int operator()(mt19937_64 &rng) const
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t k = static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return static_cast<int>(min(k, cdf.size() - 1) + 1);
+    }
+};
+
+static string userName(size_t id) { return "user" + to_string(id); }
+
+static bool writeDataset(const BenchConfig &config)
+{
+    mkdir(config.data_dir.c_str(), 0755);
+    mt19937_64 rng(config.seed);
+    ZipfSampler pick_user(config.users, config.skew);
+    ZipfSampler pick_post(config.posts, config.skew);
+
+    ofstream users_out(config.data_dir + "/users.csv");
+    users_out << "id,username,location\n";
+    for (size_t id = 1; id <= config.users; id++)
+        users_out << id << "," << userName(id) << ",City" << rng() % config.locations << "\n";
+
+    ofstream posts_out(config.data_dir + "/posts.csv");
+    posts_out << "id,content,username,views\n";
+    for (size_t id = 1; id <= config.posts; id++)
+        posts_out << id << ",Post number " << id << "," << userName(pick_user(rng)) << "," << rng() % 10000 << "\n";
+
+    ofstream engagements_out(config.data_dir + "/engagements.csv");
+    engagements_out << "id,postId,username,type,comment,timestamp\n";
+    string comment(config.comment_length, 'x');
+    long long timestamp = 1600000000;
+    for (size_t id = 1; id <= config.engagements; id++)
+    {
+        bool is_comment = uniform_real_distribution<double>(0.0, 1.0)(rng) < config.comment_ratio;
+        if (is_comment)
+        {
+            for (char &c : comment)
+                c = static_cast<char>('a' + rng() % 26);
+        }
+        timestamp += static_cast<long long>(rng() % 3);
+        engagements_out << id << "," << pick_post(rng) << "," << userName(pick_user(rng)) << ","
+                        << (is_comment ? "comment," + comment : string("like,")) << "," << timestamp << "\n";
+    }
+    return users_out.good() && posts_out.good() && engagements_out.good();
+}
+
+// =============================================================================
+// MEASUREMENT
+// =============================================================================
+
+struct BenchResult
+{
+    string name;
+    size_t ops = 0;          // operations timed
+    size_t items = 0;        // rows / ids processed (for loads and batches)
+    double total_seconds = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    uint64_t allocations = 0; // operator new calls during the run, any thread
+};
+
+static double percentile(vector<double> sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    sort(sorted.begin(), sorted.end());
+    size_t index = min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())));
+    return sorted[index];
+}
+
+/**
+ * Time op(i) for i in [0, ops), one clock read per call, and summarize.
+ * items_per_op is what op processes each call (1 for single lookups).
+ */
+template <typename OpFn>
+static BenchResult measure(const string &name, size_t ops, size_t items_per_op, OpFn &&op)
+{
+    vector<double> latencies_us;
+    latencies_us.reserve(ops);
+    uint64_t allocations_before = heap_allocations.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++)
+    {
+        auto before = chrono::steady_clock::now();
+        op(i);
+        auto after = chrono::steady_clock::now();
+        latencies_us.push_back(chrono::duration<double, micro>(after - before).count());
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    uint64_t allocations = heap_allocations.load(memory_order_relaxed) - allocations_before;
+    return BenchResult{name, ops, ops * items_per_op, total, percentile(latencies_us, 0.50),
+                       percentile(latencies_us, 0.99), allocations};
+}
+
+static void report(const BenchResult &result, ofstream &out)
+{
+    double ops_per_second = result.total_seconds > 0 ? static_cast<double>(result.ops) / result.total_seconds : 0;
+    double items_per_second = result.total_seconds > 0 ? static_cast<double>(result.items) / result.total_seconds : 0;
+    double allocations_per_item =
+        result.items > 0 ? static_cast<double>(result.allocations) / static_cast<double>(result.items) : 0;
+
+    printf("%-38s %10zu %14.0f %14.0f %11.2f %11.2f %12.2f\n", result.name.c_str(), result.ops, ops_per_second,
+           items_per_second, result.p50_us, result.p99_us, allocations_per_item);
+    out << "{\"benchmark\":\"" << result.name << "\",\"ops\":" << result.ops << ",\"items\":" << result.items
+        << ",\"seconds\":" << result.total_seconds << ",\"ops_per_sec\":" << ops_per_second
+        << ",\"items_per_sec\":" << items_per_second << ",\"p50_us\":" << result.p50_us
+        << ",\"p99_us\":" << result.p99_us << ",\"allocs_per_item\":" << allocations_per_item << "}\n";
+}
+
+// =============================================================================
+// STRESS / SCALING
+// =============================================================================
+//
+// Each round runs the same workload on t = 1, 2, 4, ... --threads threads
+// against one loaded FlatFile. Every thread, independently seeded, draws
+// --stress-ops operations:
+//
+//   reads   getPostViews / getUsername / getAllUserComments on Zipf-picked ids
+//   writes  +1 view on a Zipf-picked post, an added like/comment, or a rename
+//
+// Throughput is the total over wall time; contention is read off
+// FlatFile::stats() (waits on already-held locks during the round).
+//
+// Linearizability is checked on what the workload can predict exactly:
+// - views only grow, so a thread must never read a smaller count for a post
+//   than it read before; and after the round every post's count must equal
+//   its starting count plus every successful increment
+// - each thread renames (and adds engagements as) only users with
+//   (id - 1) % t == thread, so every add must be accepted, get an id no one
+//   else got, and each renamed user must end with the last name set
+// - at the end the FlatFile is closed and reloaded from disk, which must
+//   reproduce the in-memory views, engagement count and usernames
+
+struct StressWorker
+{
+    map<int, long long> increments; // post -> views added by this thread
+    map<int, int> last_seen;        // post -> largest count this thread read
+    vector<int> added_ids;
+    vector<double> read_us;
+    vector<double> write_us;
+    size_t violations = 0;
+    string first_violation;
+
+    void violation(const string &what)
+    {
+        if (violations++ == 0)
+            first_violation = what;
+    }
+};
+
+struct LockWait
+{
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+};
+
+static LockWait lockWaitSince(const LatencySummary &before, const LatencySummary &after)
+{
+    return LockWait{after.count - before.count, after.total_ns - before.total_ns};
+}
+
+static int runStress(const BenchConfig &config, ofstream &out, const string &users_path, const string &posts_path,
+                     const string &engagements_path)
+{
+    FlatFileOptions opts = config.stress_options;
+    opts.wal_checkpoint_interval_ms = 0;
+
+    vector<size_t> thread_counts;
+    for (size_t t = 1; t < config.threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(config.threads);
+
+    // usernames[id]: the name each user has now (renames update it)
+    vector<string> usernames(config.users + 1);
+    for (size_t id = 1; id <= config.users; id++)
+        usernames[id] = userName(id);
+
+    vector<int> all_posts(config.posts);
+    for (size_t i = 0; i < config.posts; i++)
+        all_posts[i] = static_cast<int>(i + 1);
+
+    ZipfSampler pick_user(config.users, config.skew);
+    ZipfSampler pick_post(config.posts, config.skew);
+    vector<int> final_views;
+    size_t final_engagements = 0;
+    size_t total_violations = 0;
+    double single_thread_rate = 0;
+
+    printf("\n%8s %12s %9s %11s %11s %11s %11s %14s %14s %8s\n", "threads", "ops/s", "speedup", "read p50",
+           "read p99", "write p50", "write p99", "posts waits", "users waits", "errors");
+    {
+        FlatFile db(users_path, posts_path, engagements_path, opts);
+        db.loadMultipleFlatFilesInParallel();
+
+        for (size_t round = 0; round < thread_counts.size(); round++)
+        {
+            const size_t threads = thread_counts[round];
+            vector<int> views_before = db.getPostViewsBatch(all_posts);
+            size_t engagements_before = db.getEngagementCount();
+            FlatFileStats stats_before = db.stats();
+
+            vector<StressWorker> workers(threads);
+            auto work = [&](size_t t)
+            {
+                StressWorker &me = workers[t];
+                mt19937_64 rng(config.seed * 1000003 + round * 1009 + t);
+                uniform_real_distribution<double> unit(0.0, 1.0);
+                size_t renames = 0;
+
+                // A Zipf-picked user in this thread's partition
+                auto my_user = [&]()
+                {
+                    size_t id = static_cast<size_t>(pick_user(rng));
+                    id = id - (id - 1) % threads + t;
+                    return static_cast<int>(id > config.users ? id - threads : id);
+                };
+
+                for (size_t i = 0; i < config.stress_ops; i++)
+                {
+                    auto before = chrono::steady_clock::now();
+                    bool is_read = unit(rng) < config.read_ratio;
+                    if (is_read)
+                    {
+                        double kind = unit(rng);
+                        if (kind < 0.6)
+                        {
+                            int post = pick_post(rng);
+                            int views = db.getPostViews(post);
+                            int &seen = me.last_seen[post];
+                            if (views < seen)
+                                me.violation("post " + to_string(post) + " went from " + to_string(seen) +
+                                             " to " + to_string(views) + " views");
+                            seen = max(seen, views);
+                        }
+                        else if (kind < 0.85)
+                        {
+                            int user = my_user();
+                            string name = db.getUsername(user);
+                            if (name != usernames[static_cast<size_t>(user)])
+                                me.violation("user " + to_string(user) + " reads as '" + name + "'");
+                        }
+                        else
+                        {
+                            (void)db.getAllUserComments(pick_user(rng));
+                        }
+                    }
+                    else
+                    {
+                        double kind = unit(rng);
+                        if (kind < config.add_share)
+                        {
+                            int user = my_user();
+                            bool comment = unit(rng) < config.comment_ratio;
+                            Engagement record(0, pick_post(rng), usernames[static_cast<size_t>(user)],
+                                              comment ? "comment" : "like", comment ? "stress" : "",
+                                              1700000000 + static_cast<long long>(i));
+                            db.addEngagementRecord(record);
+                            if (record.id == 0)
+                                me.violation("add as user " + to_string(user) + " was rejected");
+                            else
+                                me.added_ids.push_back(record.id);
+                        }
+                        else if (kind < config.add_share + config.rename_share)
+                        {
+                            int user = my_user();
+                            string name = "r" + to_string(round) + "_t" + to_string(t) + "_" + to_string(renames++);
+                            if (db.updateUserName(user, name))
+                                usernames[static_cast<size_t>(user)] = name; // only this thread writes this user
+                            else
+                                me.violation("rename of user " + to_string(user) + " failed");
+                        }
+                        else
+                        {
+                            int post = pick_post(rng);
+                            if (db.updatePostViews(post, 1))
+                                me.increments[post]++;
+                            else
+                                me.violation("view update of post " + to_string(post) + " failed");
+                        }
+                    }
+                    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - before).count();
+                    (is_read ? me.read_us : me.write_us).push_back(us);
+                }
+            };
+
+            auto start = chrono::steady_clock::now();
+            vector<thread> pool;
+            for (size_t t = 0; t < threads; t++)
+                pool.emplace_back(work, t);
+            for (thread &worker : pool)
+                worker.join();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            // ---- Check the round against the serial outcome ----------------
+            size_t violations = 0;
+            string first_violation;
+            auto fail = [&](const string &what)
+            {
+                if (violations++ == 0)
+                    first_violation = what;
+            };
+            for (const StressWorker &worker : workers)
+            {
+                violations += worker.violations;
+                if (first_violation.empty() && !worker.first_violation.empty())
+                    first_violation = worker.first_violation;
+            }
+
+            vector<long long> expected(views_before.begin(), views_before.end());
+            set<int> ids;
+            size_t adds = 0;
+            for (const StressWorker &worker : workers)
+            {
+                for (const auto &[post, added] : worker.increments)
+                    expected[static_cast<size_t>(post - 1)] += added;
+                for (int id : worker.added_ids)
+                {
+                    if (!ids.insert(id).second)
+                        fail("engagement id " + to_string(id) + " was handed out twice");
+                }
+                adds += worker.added_ids.size();
+            }
+            vector<int> views_after = db.getPostViewsBatch(all_posts);
+            for (size_t i = 0; i < config.posts; i++)
+            {
+                if (views_after[i] != expected[i])
+                    fail("post " + to_string(i + 1) + " has " + to_string(views_after[i]) + " views, expected " +
+                         to_string(expected[i]));
+            }
+            if (db.getEngagementCount() != engagements_before + adds)
+                fail("engagement count " + to_string(db.getEngagementCount()) + ", expected " +
+                     to_string(engagements_before + adds));
+            for (size_t id = 1; id <= config.users; id++)
+            {
+                if (db.getUsername(static_cast<int>(id)) != usernames[id])
+                    fail("user " + to_string(id) + " should be " + usernames[id]);
+            }
+
+            // ---- Report -----------------------------------------------------
+            vector<double> read_us;
+            vector<double> write_us;
+            for (const StressWorker &worker : workers)
+            {
+                read_us.insert(read_us.end(), worker.read_us.begin(), worker.read_us.end());
+                write_us.insert(write_us.end(), worker.write_us.begin(), worker.write_us.end());
+            }
+            FlatFileStats stats_after = db.stats();
+            LockWait posts_wait = lockWaitSince(stats_before.posts_lock_wait, stats_after.posts_lock_wait);
+            LockWait users_wait = lockWaitSince(stats_before.users_lock_wait, stats_after.users_lock_wait);
+            LockWait engagements_wait =
+                lockWaitSince(stats_before.engagements_lock_wait, stats_after.engagements_lock_wait);
+            LockWait file_wait = lockWaitSince(stats_before.file_lock_wait, stats_after.file_lock_wait);
+
+            size_t ops = threads * config.stress_ops;
+            double rate = seconds > 0 ? static_cast<double>(ops) / seconds : 0;
+            if (round == 0)
+                single_thread_rate = rate;
+            double speedup = single_thread_rate > 0 ? rate / single_thread_rate : 0;
+
+            printf("%8zu %12.0f %8.2fx %11.2f %11.2f %11.2f %11.2f %14llu %14llu %8zu\n", threads, rate, speedup,
+                   percentile(read_us, 0.50), percentile(read_us, 0.99), percentile(write_us, 0.50),
+                   percentile(write_us, 0.99), static_cast<unsigned long long>(posts_wait.count),
+                   static_cast<unsigned long long>(users_wait.count), violations);
+            if (violations > 0)
+                cout << "  first error: " << first_violation << endl;
+
+            out << "{\"stress\":{\"threads\":" << threads << ",\"ops\":" << ops << ",\"seconds\":" << seconds
+                << ",\"ops_per_sec\":" << rate << ",\"speedup\":" << speedup
+                << ",\"read_p50_us\":" << percentile(read_us, 0.50)
+                << ",\"read_p99_us\":" << percentile(read_us, 0.99)
+                << ",\"write_p50_us\":" << percentile(write_us, 0.50)
+                << ",\"write_p99_us\":" << percentile(write_us, 0.99)
+                << ",\"lock_waits\":{\"posts\":" << posts_wait.count << ",\"users\":" << users_wait.count
+                << ",\"engagements\":" << engagements_wait.count << ",\"file\":" << file_wait.count
+                << "},\"lock_wait_ms\":{\"posts\":" << posts_wait.total_ns / 1e6
+                << ",\"users\":" << users_wait.total_ns / 1e6
+                << ",\"engagements\":" << engagements_wait.total_ns / 1e6
+                << ",\"file\":" << file_wait.total_ns / 1e6 << "},\"violations\":" << violations << "}}\n";
+            total_violations += violations;
+        }
+
+        final_views = db.getPostViewsBatch(all_posts);
+        final_engagements = db.getEngagementCount();
+    } // closing the FlatFile flushes, checkpoints and compacts
+
+    // ---- Everything acknowledged must survive a reload ----------------------
+    FlatFile reloaded(users_path, posts_path, engagements_path, opts);
+    reloaded.loadFlatFile();
+    size_t durability_errors = 0;
+    if (reloaded.getPostViewsBatch(all_posts) != final_views)
+        durability_errors++;
+    if (reloaded.getEngagementCount() != final_engagements)
+        durability_errors++;
+    for (size_t id = 1; id <= config.users; id++)
+        durability_errors += reloaded.getUsername(static_cast<int>(id)) != usernames[id];
+    out << "{\"stress_reload\":{\"errors\":" << durability_errors << "}}\n";
+
+    if (total_violations + durability_errors > 0)
+    {
+        cout << "\nFAILED: " << total_violations << " linearizability and " << durability_errors
+             << " reload errors" << endl;
+        return 1;
+    }
+    cout << "\nAll results match a serial execution and survive a reload. Results written to " << config.out_path
+         << endl;
+    return out.good() ? 0 : 1;
+}
+
+// =============================================================================
+// BENCHMARKS
+// =============================================================================
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config))
+        return 1;
+
+    cout << "Generating " << config.users << " users, " << config.posts << " posts, " << config.engagements
+         << " engagements (skew " << config.skew << ", seed " << config.seed << ") in " << config.data_dir
+         << "/" << endl;
+    if (!writeDataset(config))
+    {
+        cerr << "Could not write the dataset to " << config.data_dir << endl;
+        return 1;
+    }
+
+    ofstream out(config.out_path);
+    out << "{\"config\":{\"users\":" << config.users << ",\"posts\":" << config.posts
+        << ",\"engagements\":" << config.engagements << ",\"skew\":" << config.skew
+        << ",\"comment_length\":" << config.comment_length << ",\"seed\":" << config.seed
+        << ",\"threads\":" << thread::hardware_concurrency() << ",\"mode\":\"" << config.mode << "\"}}\n";
+
+    const string users_path = config.data_dir + "/users.csv";
+    const string posts_path = config.data_dir + "/posts.csv";
+    const string engagements_path = config.data_dir + "/engagements.csv";
+    if (config.mode == "stress")
+        return runStress(config, out, users_path, posts_path, engagements_path);
+
+    printf("\n%-38s %10s %14s %14s %11s %11s %12s\n", "benchmark", "ops", "ops/s", "items/s", "p50 (us)",
+           "p99 (us)", "allocs/item");
+
+    const size_t rows = config.users + config.posts + config.engagements;
+
+    FlatFileOptions opts;
+    opts.wal_checkpoint_interval_ms = 0; // no background work skewing the numbers
+
+    // ---- Loaders ------------------------------------------------------------
+    {
+        FlatFile db(users_path, posts_path, engagements_path, opts);
+        report(measure("load/single_stream", config.load_runs, rows, [&](size_t)
+                       { db.loadFlatFile(); }),
+               out);
+    }
+    {
+        FlatFileOptions mapped = opts;
+        mapped.load_mode = LoadMode::MemoryMapped;
+        FlatFile db(users_path, posts_path, engagements_path, mapped);
+        report(measure("load/single_mmap", config.load_runs, rows, [&](size_t)
+                       { db.loadFlatFile(); }),
+               out);
+    }
+    {
+        FlatFile db(users_path, posts_path, engagements_path, opts);
+        report(measure("load/parallel", config.load_runs, rows, [&](size_t)
+                       { db.loadMultipleFlatFilesInParallel(); }),
+               out);
+    }
+
+    // ---- Queries ------------------------------------------------------------
+    FlatFile db(users_path, posts_path, engagements_path, opts);
+    db.loadMultipleFlatFilesInParallel();
+
+    // Ids are drawn up front (from a second generator) so every run, and
+    // every benchmark, replays exactly the same sequence
+    mt19937_64 rng(config.seed + 1);
+    ZipfSampler pick_user(config.users, config.skew);
+    ZipfSampler pick_post(config.posts, config.skew);
+    vector<int> user_ids(config.query_ops);
+    vector<int> post_ids(config.query_ops);
+    for (size_t i = 0; i < config.query_ops; i++)
+    {
+        user_ids[i] = pick_user(rng);
+        post_ids[i] = pick_post(rng);
+    }
+    vector<string> locations;
+    for (size_t i = 0; i < config.locations; i++)
+        locations.push_back("City" + to_string(i));
+
+    size_t sink = 0; // results are summed so the optimizer cannot drop the calls
+    report(measure("query/getPostViews", config.query_ops, 1, [&](size_t i)
+                   { sink += static_cast<size_t>(db.getPostViews(post_ids[i])); }),
+           out);
+    report(measure("query/getUsername", config.query_ops, 1, [&](size_t i)
+                   { sink += db.getUsername(user_ids[i]).size(); }),
+           out);
+    report(measure("query/hasUser", config.query_ops, 1, [&](size_t i)
+                   { sink += db.hasUser(user_ids[i]); }),
+           out);
+    report(measure("query/hasPost", config.query_ops, 1, [&](size_t i)
+                   { sink += db.hasPost(post_ids[i]); }),
+           out);
+    report(measure("query/getAllUserComments", config.query_ops, 1, [&](size_t i)
+                   { sink += db.getAllUserComments(user_ids[i]).size(); }),
+           out);
+    report(measure("query/getAllEngagementsByLocation", config.query_ops, 1, [&](size_t i)
+                   { sink += static_cast<size_t>(db.getAllEngagementsByLocation(locations[i % locations.size()]).first); }),
+           out);
+    // A full scan per call - a few calls are enough
+    size_t scan_ops = max<size_t>(config.query_ops / 1000, 5);
+    report(measure("query/countPostEngagements", scan_ops, 1, [&](size_t i)
+                   { sink += db.countPostEngagements(post_ids[i], EngagementType::Like); }),
+           out);
+    // Windows of about a tenth of the timestamp range (rows are ~1s apart)
+    const long long first_timestamp = 1600000000;
+    const long long window = max<long long>(static_cast<long long>(config.engagements) / 10, 1);
+    auto window_start = [&](size_t i)
+    { return first_timestamp + static_cast<long long>(i % 10) * window; };
+    report(measure("query/countPostEngagementsBetween", config.query_ops, 1, [&](size_t i)
+                   { sink += db.countPostEngagementsBetween(post_ids[i], window_start(i), window_start(i) + window); }),
+           out);
+    report(measure("query/getPostEngagementsBetween", config.query_ops, 1, [&](size_t i)
+                   { sink += db.getPostEngagementsBetween(post_ids[i], window_start(i), window_start(i) + window).size(); }),
+           out);
+    report(measure("query/getEngagementsByLocationBetween", config.query_ops, 1, [&](size_t i)
+                   { sink += static_cast<size_t>(db.getEngagementsByLocationBetween(
+                                                     locations[i % locations.size()], window_start(i),
+                                                     window_start(i) + window)
+                                                     .first); }),
+           out);
+    report(measure("query/getPostEngagementCounts", config.query_ops, 1, [&](size_t i)
+                   { sink += static_cast<size_t>(db.getPostEngagementCounts(post_ids[i]).total()); }),
+           out);
+    report(measure("query/getAuthorEngagementCounts", config.query_ops, 1, [&](size_t i)
+                   { sink += static_cast<size_t>(db.getAuthorEngagementCounts(user_ids[i]).total()); }),
+           out);
+    report(measure("query/getTopEngagedPosts(10)", config.query_ops, 1, [&](size_t)
+                   { sink += db.getTopEngagedPosts(10).size(); }),
+           out);
+    report(measure("query/counts", config.query_ops, 1, [&](size_t)
+                   { sink += db.getUserCount() + db.getPostCount() + db.getEngagementCount(); }),
+           out);
+
+    size_t batches = max<size_t>(config.query_ops / config.batch_size, 1);
+    auto batch_of = [&](const vector<int> &ids, size_t b)
+    {
+        vector<int> batch;
+        for (size_t k = 0; k < config.batch_size; k++)
+            batch.push_back(ids[(b * config.batch_size + k) % ids.size()]);
+        return batch;
+    };
+    report(measure("query/getPostViewsBatch", batches, config.batch_size, [&](size_t b)
+                   { sink += db.getPostViewsBatch(batch_of(post_ids, b)).size(); }),
+           out);
+    report(measure("query/getUsernamesBatch", batches, config.batch_size, [&](size_t b)
+                   { sink += db.getUsernamesBatch(batch_of(user_ids, b)).size(); }),
+           out);
+
+    // ---- Mutations (each one is durable: it waits for an fsync) --------------
+    const size_t mutations = config.mutation_ops;
+    report(measure("mutation/updatePostViews", mutations, 1, [&](size_t i)
+                   { sink += db.updatePostViews(post_ids[i % post_ids.size()], 1); }),
+           out);
+    size_t mutation_batches = max<size_t>(mutations / 10, 1);
+    report(measure("mutation/updatePostViewsBatch", mutation_batches, config.batch_size, [&](size_t b)
+                   {
+                       vector<pair<int, int>> updates;
+                       for (int id : batch_of(post_ids, b))
+                           updates.emplace_back(id, 1);
+                       sink += db.updatePostViewsBatch(updates); }),
+           out);
+    report(measure("mutation/addEngagementRecord", mutations, 1, [&](size_t i)
+                   {
+                       Engagement like(0, post_ids[i % post_ids.size()], userName(user_ids[i % user_ids.size()]),
+                                       "like", "", 1700000000 + static_cast<long long>(i));
+                       db.addEngagementRecord(like);
+                       sink += like.id != 0; }),
+           out);
+    report(measure("mutation/addUserRecord", mutations, 1, [&](size_t i)
+                   {
+                       User user(0, "bench_user_" + to_string(i), locations[i % locations.size()]);
+                       sink += db.addUserRecord(user); }),
+           out);
+    report(measure("mutation/updateUserName", mutations, 1, [&](size_t i)
+                   { sink += db.updateUserName(user_ids[i % user_ids.size()], "renamed_" + to_string(i)); }),
+           out);
+    report(measure("mutation/checkpoint+compact", 1, 1, [&](size_t)
+                   { sink += db.checkpoint() && db.compact(); }),
+           out);
+
+    cout << "\nResults written to " << config.out_path << " (checksum " << sink << ")" << endl;
+    return out.good() ? 0 : 1;
+}